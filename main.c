@@ -49,7 +49,15 @@
 #define UNUSED
 #endif
 
+// While recording, CTRL-C only breaks between two instructions, so it never
+// lands halfway an event in the log or an instruction that replay would run
+// in full. Waiting for the user or the clock can be broken off right away.
+
 static sigjmp_buf jump_buffer;
+static bool defer_break;
+static volatile sig_atomic_t break_pending;
+static volatile sig_atomic_t host_waiting;
+
 static void sig_handler(int _ UNUSED) {
 #if 0
     rl_stuff_char('O');
@@ -57,7 +65,8 @@ static void sig_handler(int _ UNUSED) {
     rl_stuff_char('D');
     rl_stuff_char('\n');
 #endif
-    siglongjmp(jump_buffer,1);
+    if (defer_break && !host_waiting) break_pending = 1;
+    else siglongjmp(jump_buffer,1);
 }
 static void sig_handler2(int _ UNUSED) {
     exit(0);
@@ -71,6 +80,17 @@ static const uint16_t lomem = 0x0800;
 static const uint16_t himem = 0xb800;
 
 #define ESCFLG 0xff
+#define BASSP  0x04         // BASIC stack pointer, grows down from HIMEM
+#define PTRB   0x19         // BASIC text pointer during expression evaluation
+#define IACC   0x2a         // BASIC integer accumulator
+#define FACC   0x2e         // BASIC floating point accumulator
+#define STRLEN 0x36         // length of string in STRBUF
+#define ATPCT  0x0400       // @%
+#define STRBUF 0x0600       // BASIC string work area
+
+#define MOS_RTS 0xffcd      // RTS in the MOS, return from BASIC hook
+#define TOO_BIG 0xde82      // BRK with "Too big" error in BASIC
+#define TOO_LONG 0xd419     // BRK with "String too long" error in BASIC
 
 #define basic_start 0xb800
 #define mos_start   0xff00
@@ -80,6 +100,15 @@ static uint8_t basic[16384];
 static uint8_t mos[256];
 
 static struct timeval start_time;
+static struct timespec start_mono;  // for the nanosecond clock of OSWORD &E0
+
+#define IDLE_POLLS 8        // side effect free clock reads before we sleep
+
+static unsigned idle_polls;
+static uint16_t idle_ptr;   // program text position of the last clock read
+static bool guest_dirty;    // guest wrote to its variables or did other I/O
+
+static uint64_t cycles;     // emulated cycles since startup
 
 #define NHANDLES 6
 
@@ -97,17 +126,21 @@ static void reset_terminal_mode(void) {
     tcsetattr(0, TCSANOW, &orig_termios);
 }
 
-static int kbhit() {
-    struct timeval tv = { 0L, 0L };
+// wait at most usec microseconds for a key, forever if usec < 0
+static int kbhit(long usec) {
+    struct timeval tv = { usec / 1000000, usec % 1000000 };
     fd_set fds;
     FD_ZERO(&fds);
     FD_SET(0, &fds);
-    return select(1, &fds, NULL, NULL, &tv) > 0;
+    host_waiting = 1;
+    int ret = select(1, &fds, NULL, NULL, usec < 0 ? NULL : &tv);
+    host_waiting = 0;
+    return ret > 0;
 }
 
 static char getkey() {
     char keybuf[32];
-    while (!kbhit()) ;
+    while (!kbhit(-1)) ;
     int len UNUSED = read(0, keybuf,32);;
     return keybuf[0] & 0x7f;
 }
@@ -135,8 +168,19 @@ uint8_t read6502(uint16_t a) {
         return mem[a];
 }
 
+// Anything but BASIC's scratch space: zero page workspace, FP temporaries,
+// string and input buffers, and the BASIC stack below HIMEM.
+static inline bool guest_state(uint16_t a) {
+    if (a >= 0x70 && a < 0x90) return true;     // user zero page
+    if (a < 0x0400) return false;
+    if (a >= 0x046c && a < 0x0480) return false;
+    if (a >= 0x0600 && a < 0x0800) return false;
+    return a < mem[BASSP] + (mem[BASSP+1]<<8);
+}
+
 void write6502(uint16_t a, uint8_t v) {
     mem[a] = v;
+    if (!guest_dirty && guest_state(a)) guest_dirty = true;
 }
 
 // ----------------------------------------------------------------------------
@@ -163,6 +207,207 @@ static inline void set_carry(void) {
     setP(getP() | 1);
 }
 
+static inline void lda(uint8_t v) {     // load A and set N and Z like LDA
+    A = v;
+    setP((getP() & ~0x82) | (v & 0x80) | (v ? 0 : 0x02));
+}
+
+static inline void adc_overflow(uint8_t a, uint8_t m, uint8_t r) {
+    setP((getP() & ~0x40) | (~(a ^ m) & (a ^ r) & 0x80) >> 1);
+}
+
+// ----------------------------------------------------------------------------
+
+// time since start_time in microseconds, TIME is this divided by 10000
+static uint64_t clock_usec(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start_time.tv_sec) * 1000000LL +
+           (now.tv_usec - start_time.tv_usec);
+}
+
+// monotonic time since startup in nanoseconds, not affected by TIME=
+static uint64_t clock_nsec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start_mono.tv_sec) * 1000000000LL +
+           (now.tv_nsec - start_mono.tv_nsec);
+}
+
+// A guest that keeps reading the clock at the same place in its program
+// without changing any of its variables or doing other I/O in between is busy
+// waiting, e.g. REPEAT UNTIL TIME>T%. It cannot tell whether it polls a
+// thousand times per centisecond or once, so after a few of those reads we
+// sleep until the clock ticks over.
+
+static void idle_poll(void) {
+    uint16_t ptr = mem[PTRB] + (mem[PTRB+1]<<8) + mem[PTRB+2];
+    if (guest_dirty || ptr != idle_ptr) {
+        idle_ptr = ptr;
+        guest_dirty = false;
+        idle_polls = 0;
+    } else if (idle_polls < IDLE_POLLS) {
+        idle_polls++;
+    } else {
+        host_waiting = 1;
+        usleep(10000 - clock_usec() % 10000);
+        host_waiting = 0;
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+// Record and replay of everything the guest gets from the outside world
+//
+// The log starts with a magic number, followed by one event per MOS call that
+// returned something nondeterministic: a type byte, the number of cycles since
+// the previous event and the result, the latter two as LEB128 varints. Lines
+// read by OSWORD 0 have their length as result, followed by the bytes.
+// Pressing CTRL-C is logged as well, so it can be redone at the same cycle.
+// Events that waited for the user are flushed right away, so a session that
+// gets killed still leaves a log of everything up to its last input.
+
+#define EV_LINE  'L'        // OSWORD 0
+#define EV_TIME  'T'        // OSWORD 1
+#define EV_CLOCK 'N'        // OSWORD &E0, nanoseconds
+#define EV_INKEY 'I'        // OSBYTE &81, &ff is time out
+#define EV_KEY   'K'        // OSRDCH
+#define EV_BREAK 'B'        // CTRL-C
+
+static const char log_magic[4] = "RBL1";
+
+static FILE *record_file;
+static FILE *replay_file;
+static uint64_t event_cycles;       // cycle count of the previous event
+static int replay_type;             // next event in the replay log, or EOF
+static uint64_t replay_at;          // cycle count of the next event
+static uint64_t replay_break = UINT64_MAX;
+static bool replay_diverged;
+
+static void open_record(char *fname) {
+    if (!(record_file = fopen(fname, "wb"))) {
+        fprintf(stderr, "unable to open %s\n", fname);
+        exit(1);
+    }
+    fwrite(log_magic, sizeof(log_magic), 1, record_file);
+    fflush(record_file);
+}
+
+static void put_varint(uint64_t v) {
+    while (v >= 0x80) {
+        fputc((v & 0x7f) | 0x80, record_file);
+        v >>= 7;
+    }
+    fputc(v, record_file);
+}
+
+static void record(int type, uint64_t v) {
+    if (!record_file) return;
+    fputc(type, record_file);
+    put_varint(cycles - event_cycles);
+    put_varint(v);
+    event_cycles = cycles;
+    if (type == EV_INKEY || type == EV_KEY || type == EV_BREAK)
+        fflush(record_file);
+}
+
+static void record_line(char *line) {
+    size_t len = strlen(line);
+    record(EV_LINE, len);
+    if (!record_file) return;
+    fwrite(line, len, 1, record_file);
+    fflush(record_file);
+}
+
+static bool get_varint(uint64_t *v) {
+    int c, shift = 0;
+    *v = 0;
+    do {
+        if ((c = fgetc(replay_file)) == EOF) return false;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return true;
+}
+
+// Reads the next event up front. A log that ends halfway an event was cut
+// short by killing the recording, so it ends right before that event.
+
+static uint64_t replay_value;       // result of the next event
+static char *replay_text;           // and its line for EV_LINE
+
+static void replay_next(void) {
+    uint64_t delta = 0;
+    replay_type = fgetc(replay_file);
+    if (replay_type != EOF &&
+        (!get_varint(&delta) || !get_varint(&replay_value)))
+        replay_type = EOF;
+    if (replay_type == EV_LINE) {
+        replay_text = malloc(replay_value + 1);
+        if (!replay_text) {
+            fprintf(stderr, "replay: out of memory\n");
+            exit(1);
+        }
+        if (replay_value &&
+            fread(replay_text, replay_value, 1, replay_file) != 1) {
+            free(replay_text);
+            replay_type = EOF;
+        } else {
+            replay_text[replay_value] = 0;
+        }
+    }
+    replay_at = replay_type == EOF ? UINT64_MAX : event_cycles + delta;
+    replay_break = replay_type == EV_BREAK ? replay_at : UINT64_MAX;
+}
+
+static void open_replay(char *fname) {
+    char magic[sizeof(log_magic)];
+    if (!(replay_file = fopen(fname, "rb"))) {
+        fprintf(stderr, "unable to open %s\n", fname);
+        exit(1);
+    }
+    if (fread(magic, sizeof(magic), 1, replay_file) != 1 ||
+        memcmp(magic, log_magic, sizeof(magic))) {
+        fprintf(stderr, "%s is not a replay log\n", fname);
+        exit(1);
+    }
+    replay_next();
+}
+
+// Returns the result of the next event, which has to be of the given type.
+// Running out of events means the recorded session ended here.
+
+static uint64_t replay_event(int type) {
+    if (replay_type == EOF) exit(0);
+    if (replay_type != type) {
+        fprintf(stderr, "replay: expected event '%c', log has '%c'\n",
+                                                        type, replay_type);
+        exit(1);
+    }
+    if (replay_at != cycles && !replay_diverged) {
+        fprintf(stderr, "replay: diverged at cycle %llu, recorded at %llu\n",
+                (unsigned long long) cycles, (unsigned long long) replay_at);
+        replay_diverged = true;
+    }
+    event_cycles = replay_at;
+    return replay_value;
+}
+
+static uint64_t replay(int type) {
+    uint64_t v = replay_event(type);
+    replay_next();
+    return v;
+}
+
+static char *replay_line(void) {
+    replay_event(EV_LINE);
+    char *line = replay_text;
+    replay_next();
+    if (*line) printf("%s\n", line);  // echo like readline, OSWORD 0 does ""
+
+    return line;
+}
+
 // ----------------------------------------------------------------------------
 
 static void OSBYTE(void) {
@@ -184,36 +429,38 @@ static void OSBYTE(void) {
         }        
         break;
     case 0x81: {    // Read key with time limit
-        uint16_t timeout = X + (Y<<8);
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        now.tv_sec -= start_time.tv_sec;
-        now.tv_usec -= start_time.tv_usec;
-        uint64_t v = now.tv_sec * 100 + (now.tv_usec / 10000);
-        make_term_raw();
-        while (1) {
-            if (kbhit()) {
-                X = getkey();
-                Y = 0;
-                if (X == 0x1b) {
-                    Y = 0x1b;
-                    mem[ESCFLG] = 0xff;
-                    set_carry();
-                } else {
-                    clear_carry();
+        uint8_t key = 0xff;
+        if (replay_file) {
+            key = replay(EV_INKEY);
+        } else {
+            uint16_t timeout = X + (Y<<8);
+            uint64_t end = (clock_usec() / 10000 + timeout + 1) * 10000;
+            make_term_raw();
+            while (1) {
+                uint64_t now = clock_usec();
+                if (now >= end) break;
+                if (kbhit(end - now)) {
+                    key = getkey();
+                    break;
                 }
-                reset_terminal_mode();
-                return;
             }
-            gettimeofday(&now, NULL);
-            now.tv_sec -= start_time.tv_sec;
-            now.tv_usec -= start_time.tv_usec;
-            uint64_t w = now.tv_sec * 100 + (now.tv_usec / 10000);
-            if (w-v > timeout) break;
+            reset_terminal_mode();
+        }
+        record(EV_INKEY, key);
+        if (key == 0xff) {          // time out
+            Y = 0xff;
+            set_carry();
+        } else {
+            X = key;
+            Y = 0;
+            if (X == 0x1b) {
+                Y = 0x1b;
+                mem[ESCFLG] = 0xff;
+                set_carry();
+            } else {
+                clear_carry();
+            }
         }
-        Y = 0xff;
-        set_carry();
-        reset_terminal_mode();
         }
         break;
     case 0x82:      // Read machine high order address
@@ -273,9 +520,16 @@ static void OSWORD(void) {
         uint8_t max = mem[ptr+4];
         char *lineptr = NULL;
 
-        while (!(lineptr = readline(""))) {
-            clearerr(stdin);    // ignore ctrl-D
+        if (replay_file) {
+            lineptr = replay_line();
+        } else {
+            host_waiting = 1;
+            while (!(lineptr = readline(""))) {
+                clearerr(stdin);    // ignore ctrl-D
+            }
+            host_waiting = 0;
         }
+        record_line(lineptr);
 
         if (strlen(lineptr) > 0) add_history(lineptr);
         else putchar('\n');
@@ -306,11 +560,14 @@ static void OSWORD(void) {
         break;
         }
     case 0x01: {            // Get system clock in centiseconds
-            struct timeval now;
-            gettimeofday(&now, NULL);
-            now.tv_sec -= start_time.tv_sec;
-            now.tv_usec -= start_time.tv_usec;
-            uint64_t v = now.tv_sec * 100 + (now.tv_usec / 10000);
+            uint64_t v;
+            if (replay_file) {
+                v = replay(EV_TIME);
+            } else {
+                idle_poll();
+                v = clock_usec() / 10000;
+            }
+            record(EV_TIME, v);
             uint16_t ptr = X + (Y<<8);
             mem[ptr+0] = (v>> 0) & 0xff;
             mem[ptr+1] = (v>> 8) & 0xff;
@@ -341,6 +598,20 @@ static void OSWORD(void) {
             mem[ptr+4] = 0xff;          // return off screen
         }
         break;
+    case 0xe0: {            // Read emulated cycles and host nanoseconds
+            uint64_t c = cycles, v;
+            if (replay_file) {
+                v = replay(EV_CLOCK);
+            } else {
+                v = clock_nsec();
+            }
+            record(EV_CLOCK, v);
+            for (int i=0; i<8; i++, c >>= 8, v >>= 8) {
+                mem[ptr+i] = c & 0xff;
+                mem[ptr+8+i] = v & 0xff;
+            }
+        }
+        break;
     default:
         printf("Unhandled OSWORD A=&%02x, X=&%02x, Y=&%02x\n", A, X, Y);
         exit(1);
@@ -368,9 +639,14 @@ static void OSASCI(void) {
 // ----------------------------------------------------------------------------
 
 static void OSRDCH(void) {
-    make_term_raw();
-    A = getkey();
-    reset_terminal_mode();
+    if (replay_file) {
+        A = replay(EV_KEY);
+    } else {
+        make_term_raw();
+        A = getkey();
+        reset_terminal_mode();
+    }
+    record(EV_KEY, A);
     if (A == 0x1b) {
         mem[ESCFLG] = 0xff;
         set_carry();
@@ -687,8 +963,547 @@ static void OSCLI(void) {
 
 // ----------------------------------------------------------------------------
 
+// BASIC's floating point accumulator, with the exponent overflow byte folded
+// into exp, and the 32-bit mantissa and rounding byte as one 40-bit mantissa.
+// The arithmetic below follows the ROM bit for bit, down to which bits are
+// shifted out and which are added back in, so results match the ROM exactly.
+
+struct fpacc {
+    uint8_t sign;           // bit 7
+    int exp;                // 0x81 is 2^0
+    uint64_t man;           // normalised, bit 39 set unless zero
+};
+
+#define MAN_MASK 0xffffffffffULL
+
+static const struct fpacc fp_one = { 0, 0x81, 0x8000000000ULL };
+
+static inline int32_t get_iacc(void) {
+    return GET32LE(IACC);
+}
+
+static inline void put_iacc(uint32_t v) {
+    mem[IACC+0] = v;
+    mem[IACC+1] = v >> 8;
+    mem[IACC+2] = v >> 16;
+    mem[IACC+3] = v >> 24;
+}
+
+static void fp_get(struct fpacc *f) {
+    f->sign = mem[FACC];
+    f->exp = (int8_t) mem[FACC+1] * 256 + mem[FACC+2];
+    f->man = 0;
+    for (int i=3; i<8; i++)
+        f->man = f->man << 8 | mem[FACC+i];
+}
+
+static void fp_put(const struct fpacc *f) {
+    uint64_t m = f->man;
+    mem[FACC+0] = f->sign;
+    mem[FACC+1] = f->exp >> 8;
+    mem[FACC+2] = f->exp;
+    for (int i=7; i>=3; i--, m >>= 8)
+        mem[FACC+i] = m;
+}
+
+static void fp_normalise(struct fpacc *f) {
+    if (!f->man) {
+        f->sign = f->exp = 0;
+        return;
+    }
+    while (!(f->man & 0xff00000000ULL)) {
+        f->man <<= 8;
+        f->exp -= 8;
+    }
+    while (!(f->man & 0x8000000000ULL)) {
+        f->man <<= 1;
+        f->exp--;
+    }
+}
+
+// add to the mantissa, shift back on overflow
+static void fp_addm(struct fpacc *f, uint64_t m, int carry) {
+    f->man += m + carry;
+    if (f->man > MAN_MASK) {
+        f->man >>= 1;
+        f->exp++;
+    }
+}
+
+// add two positive numbers
+static void fp_add(struct fpacc *f, const struct fpacc *b) {
+    uint64_t m = b->man;
+    if (!f->man) {
+        *f = *b;
+        return;
+    }
+    if (f->exp > b->exp) {
+        if (f->exp - b->exp >= 0x25) return;
+        m >>= f->exp - b->exp;
+    } else if (f->exp < b->exp) {
+        if (b->exp - f->exp >= 0x25) {
+            *f = *b;
+            return;
+        }
+        f->man >>= b->exp - f->exp;
+        f->exp = b->exp;
+    }
+    fp_addm(f, m, 0);
+}
+
+// x*8 + x*2
+static void fp_mul10(struct fpacc *f) {
+    f->exp += 3;
+    fp_addm(f, f->man >> 2, (f->man >> 1) & 1);
+}
+
+// x/16 * 1.6, as x * 1.5 * 17/16 * 257/256 * 65537/65536 * (1 + 2^-32)
+static void fp_div10(struct fpacc *f) {
+    f->exp -= 4;
+    fp_addm(f, f->man >> 1, f->man & 1);
+    fp_addm(f, f->man >> 4, (f->man >> 3) & 1);
+    fp_addm(f, f->man >> 8, (f->man >> 7) & 1);
+    fp_addm(f, f->man >> 16, (f->man >> 15) & 1);
+    fp_addm(f, f->man >> 32, (f->man >> 31) & 1);
+}
+
+// round to 32 bits, false if it overflowed
+static bool fp_round(struct fpacc *f) {
+    uint8_t r = f->man;
+    if (r == 0x80) f->man |= 0x100;
+    else if (r > 0x80) fp_addm(f, 0x100, 0);
+    f->man &= ~0xffULL;
+    if (f->exp > 0xff) return false;
+    if (f->exp < 0) *f = (struct fpacc) { 0, 0, 0 };
+    return true;
+}
+
+static void int_to_fp(struct fpacc *f, int32_t v) {
+    f->sign = v < 0 ? 0xff : 0;
+    f->exp = 0xa0;
+    f->man = (uint64_t) (v < 0 ? -(uint32_t) v : (uint32_t) v) << 8;
+    fp_normalise(f);
+}
+
+// ----------------------------------------------------------------------------
+
+// Number to string in STRBUF, as used by PRINT and STR$. Y is the type of the
+// number and bit 7 of &15 is set for hexadecimal. fmt and digits are the
+// format and number of digits from @%.
+
+static uint16_t num_to_str(int fmt, int digits) {
+    char buf[64];
+    int len = 0, n, pt;
+    int8_t e = 0;
+    struct fpacc f, x, r;
+
+    if (mem[0x15] & 0x80) {
+        if (Y & 0x80) return 0;         // float, might be Too big
+        len = sprintf(buf, "%X", (uint32_t) get_iacc());
+        goto done;
+    }
+
+    if (Y & 0x80) fp_get(&f);
+    else int_to_fp(&f, get_iacc());
+
+    if (!f.man) {
+        if (!fmt) {
+            buf[len++] = '0';
+            goto done;
+        }
+        n = digits;
+        if (fmt == 1) {
+            pt = 1;
+            goto print;
+        }
+        goto zero;
+    }
+    if (f.sign & 0x80) buf[len++] = '-';
+    f.sign = 0;
+
+scale:                                  // to 1 <= f < 10, f * 10^e
+    while (1) {
+        if (f.exp < 0x81) {
+            fp_mul10(&f);
+            e--;
+        } else if (f.exp > 0x84 || (f.exp == 0x84 && f.man >= 0xa000000000ULL)) {
+            fp_div10(&f);
+            e++;
+        } else {
+            break;
+        }
+    }
+
+    x = f;
+    n = digits;
+    if (fmt == 2) {
+        n = (int8_t) (digits + e + 1);
+        if (n < 0) goto zero;
+        if (n >= 11) {
+            n = 10;
+            fmt = 0;
+        }
+    }
+
+    r = (struct fpacc) { 0, 0x83, 0xa000000000ULL };      // 5 / 10^n
+    for (int i=0; i<n; i++)
+        fp_div10(&r);
+    fp_add(&r, &x);
+    while (r.exp < 0x84) {                      // 4.36 fixed point
+        r.man >>= 1;
+        r.exp++;
+    }
+    if (r.man >= 0xa000000000ULL) {             // rounded up to 10
+        f = fp_one;
+        e++;
+        goto scale;
+    }
+    f = r;
+    if (n) goto point;
+
+zero:
+    f.man = 0;
+    e = 0;
+    n = digits + 1;
+
+point:
+    if (fmt == 1) {
+        pt = 1;
+    } else if (e >= 0) {
+        if (e >= n) {
+            pt = 1;
+        } else {
+            pt = e + 1;
+            e = 0;
+        }
+    } else if (fmt == 2 || e == -1) {
+        buf[len++] = '0';
+        buf[len++] = '.';
+        while (++e) buf[len++] = '0';
+        pt = 0x80;
+    } else {
+        pt = 1;
+    }
+
+print:
+    while (n--) {
+        buf[len++] = '0' + (f.man >> 36);
+        f.man = (f.man & 0xfffffffffULL) * 10;
+        if (!--pt) buf[len++] = '.';
+    }
+
+    if (!fmt) {
+        while (buf[--len] == '0') ;
+        if (buf[len] != '.') len++;
+    }
+    if (fmt == 1 || e) {
+        int v = e < 0 ? -e : e;
+        buf[len++] = 'E';
+        if (e < 0) buf[len++] = '-';
+        if (v >= 10) buf[len++] = '0' | v / 10;
+        buf[len++] = '0' | v % 10;
+        if (fmt) {
+            if (e >= 0) buf[len++] = ' ';
+            if (v < 10) buf[len++] = ' ';
+        }
+    }
+
+done:
+    memcpy(&mem[STRBUF], buf, len);
+    mem[STRLEN] = len;
+    return MOS_RTS;
+}
+
+static uint16_t basic_print_num(void) {
+    int fmt = mem[ATPCT+2];
+    int digits = mem[ATPCT+1];
+    if (fmt >= 3) fmt = 0;
+    if (digits ? digits > 10 : fmt != 2) digits = 10;
+    return num_to_str(fmt, digits);
+}
+
+static uint16_t basic_str_num(void) {       // STR$ when @% does not apply
+    return num_to_str(mem[0x37], 10);
+}
+
+// ----------------------------------------------------------------------------
+
+// the integer result of the decimal reader is left in the FACC mantissa too
+static void iacc_to_man(void) {
+    mem[FACC+3] = 0;
+    for (int i=0; i<4; i++)
+        mem[FACC+7-i] = mem[IACC+i];
+}
+
+// Read a decimal number from the text at PTRB, offset Y, first character in
+// A. Returns type &40 in A with the value in IACC if it fits, type &FF with
+// the value in FACC otherwise, and carry clear if it is not a number at all.
+
+static uint16_t basic_read_num(void) {
+    uint16_t p = mem[PTRB] + (mem[PTRB+1]<<8);
+    uint8_t y = Y, c = A;
+    int8_t e = 0;
+    bool dot = false;
+    struct fpacc f = { 0, 0, 0 };
+
+    if (c != '.') {
+        if (!isdigit(c)) {
+            fp_put(&f);
+            lda(0xff);
+            clear_carry();
+            return MOS_RTS;
+        }
+        f.man = c - '0';
+        c = mem[(uint16_t)(p + ++y)];
+    }
+    while (1) {
+        if (c == '.') {
+            if (dot) break;
+            dot = true;
+        } else if (c == 'E') {
+            int v = 0;
+            bool neg = false;
+            c = mem[(uint16_t)(p + ++y)];
+            if (c == '-' || c == '+') {
+                neg = c == '-';
+                c = mem[(uint16_t)(p + ++y)];
+            }
+            if (isdigit(c)) {
+                v = c - '0';
+                c = mem[(uint16_t)(p + ++y)];
+                if (isdigit(c)) {
+                    v = v * 10 + c - '0';
+                    y++;
+                }
+            }
+            e += neg ? -v : v;
+            break;
+        } else if (!isdigit(c)) {
+            break;
+        } else if (f.man >= 0x1800000000ULL) {  // no more room, drop digit
+            if (!dot) e++;
+        } else {
+            if (dot) e--;
+            f.man = f.man * 10 + c - '0';
+        }
+        c = mem[(uint16_t)(p + ++y)];
+    }
+    mem[PTRB+2] = Y = y;
+    mem[0x48] = dot;
+    mem[0x49] = f.man ? 0 : e;  // the ROM counts it down while scaling
+
+    if (!e && !dot && f.man < 0x80000000ULL) {
+        put_iacc(f.man);
+        iacc_to_man();
+        X = 0;
+        lda(0x40);
+    } else {
+        if (f.man) {
+            f.exp = 0xa8;
+            fp_normalise(&f);
+            for (; e > 0; e--) fp_mul10(&f);
+            for (; e < 0; e++) fp_div10(&f);
+            if (!fp_round(&f)) return TOO_BIG;
+        }
+        fp_put(&f);
+        lda(0xff);
+    }
+    set_carry();
+    return MOS_RTS;
+}
+
+// ----------------------------------------------------------------------------
+
+// String copies, STRING$ and INSTR. These are hooked inside the ROM routines,
+// where the byte loops start, and continue with the ROM code after the loop.
+// Strings outside RAM are left to the ROM.
+
+static inline uint16_t bas_sp(void) {
+    return mem[BASSP] + (mem[BASSP+1]<<8);
+}
+
+// copy like the ROM does, from the last byte down to the first
+static void copy_down(uint16_t to, uint16_t from, int len) {
+    if (to >= from || to + len <= from)
+        memmove(&mem[to], &mem[from], len);
+    else
+        while (len--) mem[to+len] = mem[from+len];
+}
+
+// push STRBUF on the BASIC stack, after room has been made
+static uint16_t basic_push_str(void) {
+    copy_down(bas_sp() + 1, STRBUF, mem[STRLEN]);
+    Y = 0;
+    return 0xf5c9;
+}
+
+// pop a string from the BASIC stack into STRBUF
+static uint16_t basic_pop_str(void) {
+    uint16_t sp = bas_sp();
+    if (sp + 1 + mem[sp] > basic_start) return 0;
+    mem[STRLEN] = mem[sp];
+    copy_down(STRBUF, sp + 1, mem[sp]);
+    return 0xf5df;
+}
+
+// string variable with its data at (&37) and length &36 into STRBUF
+static uint16_t basic_load_str(void) {
+    uint16_t p = mem[0x37] + (mem[0x38]<<8);
+    if (!mem[STRLEN] || p + mem[STRLEN] > basic_start) return 0;
+    copy_down(STRBUF, p, mem[STRLEN]);
+    Y = 0;
+    lda(0);
+    return 0xebaa;
+}
+
+// string on the BASIC stack + STRBUF, operator in X
+static uint16_t basic_concat(void) {
+    uint16_t sp = bas_sp();
+    int left = mem[sp], len = mem[STRLEN];
+    if (!len) return 0;             // the ROM copies 256 bytes then
+    if (sp + 1 + left > basic_start) return 0;
+    mem[0x37] = X;
+    if (left + len > 255) {
+        lda(left + len);
+        set_carry();
+        adc_overflow(left, len, A);
+        return TOO_LONG;
+    }
+    copy_down(STRBUF + left, STRBUF, len);
+    copy_down(STRBUF, sp + 1, left);
+    adc_overflow(left, sp, left + sp + 1);
+    sp += left + 1;
+    mem[BASSP] = sp;
+    mem[BASSP+1] = sp >> 8;
+    mem[STRLEN] = left + len;
+    Y = 0;
+    lda(left + len);
+    return 0xd453;
+}
+
+// STRING$, repeat STRBUF the number of times in IACC (low byte only)
+static uint16_t basic_string(void) {
+    int len = mem[STRLEN], n = mem[IACC];
+    Y = len;
+    if (!len) return 0xe8f9;
+    if (!n) {
+        lda(0);
+        return 0xe8fc;
+    }
+    mem[IACC] = 0;
+    if (n == 1) return 0xe8f9;
+    if (len * n > 255) {
+        for (int i=len; i<256; i++)
+            mem[STRBUF+i] = mem[STRBUF+i%len];
+        mem[IACC] = n - 255 / len;
+        X = 255 % len + 1;
+        A = mem[STRBUF + X - 1];
+        if (X == 1 && len != 255) set_carry();
+        else if (X != 1) clear_carry();
+        Y = 0;
+        setP((getP() & ~0x80) | 0x02);
+        return TOO_LONG;
+    }
+    for (int i=1; i<n; i++)
+        memcpy(&mem[STRBUF+i*len], &mem[STRBUF], len);
+    mem[STRLEN] = Y = len * n;
+    X = len;
+    set_carry();
+    return 0xe8f9;
+}
+
+// INSTR, drop the searched string from the BASIC stack and find STRBUF in it
+// at (&37), trying &2B positions starting with position &2A
+static uint16_t basic_instr(void) {
+    uint16_t p = mem[0x37] + (mem[0x38]<<8), sp = bas_sp();
+    int len = mem[STRLEN], n = mem[0x2b] ? mem[0x2b] : 256, k;
+    if (p + n + len - 2 >= basic_start) return 0;  // last byte compared
+    uint8_t *s = &mem[p], *end = s + n;
+    adc_overflow(mem[sp], sp, mem[sp] + sp + 1);
+    setP((getP() & ~1) | ((sp & 0xff) + mem[sp] + 1 > 0xff));
+    sp += mem[sp] + 1;
+    mem[BASSP] = sp;
+    mem[BASSP+1] = sp >> 8;
+    Y = X = 0;
+    if (len) {
+        uint8_t *q = s;
+        while ((q = memchr(q, mem[STRBUF], end - q))) {
+            if (!memcmp(q, &mem[STRBUF], len)) break;
+            q++;
+        }
+        if (!q) {                       // same registers as the ROM
+            uint8_t *last = end - 1;
+            while (last[Y] == mem[STRBUF+Y]) Y++;
+            X = len - Y;
+            setP((getP() & ~1) | (last[Y] >= mem[STRBUF+Y]));
+            mem[0x2a] += n;
+            mem[0x2b] = 0;
+            p += n - 1;
+            mem[0x37] = p;
+            mem[0x38] = p >> 8;
+            A = 0;
+            return 0xe6cf;
+        }
+        k = q - s;
+        Y = len;
+        set_carry();
+    } else {
+        k = 0;
+    }
+    mem[0x2a] += k;
+    mem[0x2b] -= k;
+    p += k;
+    mem[0x37] = p;
+    mem[0x38] = p >> 8;
+    A = mem[0x2a];
+    return 0xe6cf;
+}
+
+// ----------------------------------------------------------------------------
+
+// Some BASIC routines are done in C. When the 6502 is about to execute the
+// entry point of one, the handler is called instead, and returns where to
+// continue: MOS_RTS to return from the routine, an address further on in the
+// ROM routine, the address of an error BRK in the ROM, or 0 to run the
+// original code after all. The ROM image itself is not patched, so programs
+// that read it see the original bytes.
+
+struct hook {
+    uint16_t addr;
+    uint16_t (*func)(void);
+};
+
+static struct hook hooks[] = {
+    { 0xd6f5, basic_print_num },
+    { 0xd70f, basic_str_num   },
+    { 0xd891, basic_read_num  },
+    { 0xf5bd, basic_push_str  },
+    { 0xf5ce, basic_pop_str   },
+    { 0xeb9f, basic_load_str  },
+    { 0xd434, basic_concat    },
+    { 0xe8d7, basic_string    },
+    { 0xe540, basic_instr     },
+};
+
+#define NHOOKS (sizeof(hooks) / sizeof(*hooks))
+
+static uint8_t hook_at[65536];  // index in hooks[] plus one, 0 if none
+
+static void init_hooks(void) {
+    for (unsigned i=0; i<NHOOKS; i++)
+        hook_at[hooks[i].addr] = i + 1;
+}
+
+static void basic_hook(void) {
+    uint16_t next = hooks[hook_at[PC] - 1].func();
+    if (next) PC = next;
+}
+
+// ----------------------------------------------------------------------------
+
 static void trap(void) {
     //printf("trap: PC=%04x, A=%02x, X=%02x, Y=%02x\n", PC, A, X, Y);
+    if (PC != 0xfff1 || A != 0x01) guest_dirty = true;
     switch (PC) {
     case 0xffce:    OSFIND();   break;
     case 0xffd4:    OSBPUT();   break;
@@ -751,30 +1566,66 @@ static char ** completer(const char *text, int start UNUSED, int end UNUSED) {
 
 // ----------------------------------------------------------------------------
 
-int main(int argc UNUSED, char **argv UNUSED) {
+static inline void execute(void) {
+//    printf("%04x\n", PC);
+    if (hook_at[PC]) basic_hook();
+    else if (read6502(PC) == TRAP) trap();
+    cycles += step6502();
+}
+
+static void usage(char *argv0) {
+    fprintf(stderr, "usage: %s [--record log | --replay log]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
     bool running = true;
 
+    for (int i=1; i<argc; i++) {
+        if (i+1 == argc || record_file || replay_file) usage(argv[0]);
+        if (!strcmp(argv[i], "--record"))       open_record(argv[++i]);
+        else if (!strcmp(argv[i], "--replay"))  open_replay(argv[++i]);
+        else usage(argv[0]);
+    }
+
     rl_attempted_completion_function = completer;
     if (RL_VERSION_MAJOR >= 8)
         rl_variable_bind ("enable-bracketed-paste", "off");
 
     load_rom(mos, "toprom/top.rom", sizeof(mos));
     load_rom(basic, "roms/basic310hi.rom", sizeof(basic));
+    init_hooks();
 
     save_termios();
+    clock_gettime(CLOCK_MONOTONIC, &start_mono);
 
-    sigsetjmp(jump_buffer, 1);
+    if (sigsetjmp(jump_buffer, 1)) {        // back here after CTRL-C
+        break_pending = host_waiting = 0;
+        if (replay_file) replay(EV_BREAK);
+        else record(EV_BREAK, 0);
+    }
+    defer_break = record_file != NULL;
     signal(SIGINT, sig_handler);
     signal(SIGTSTP, sig_handler2);
+    signal(SIGTERM, sig_handler2);      // exit() flushes the record log
+    signal(SIGHUP, sig_handler2);
 
     gettimeofday(&start_time, NULL);
 
     putchar('\n');
     reset6502();
 
-    while (running) {
-//        printf("%04x\n", PC);
-        if (read6502(PC) == TRAP) trap();
-        /* int spent = */ step6502();
+    if (replay_file) {
+        while (running) {
+            if (cycles >= replay_break) siglongjmp(jump_buffer, 1);
+            execute();
+        }
+    } else if (record_file) {
+        while (running) {
+            if (break_pending) siglongjmp(jump_buffer, 1);
+            execute();
+        }
+    } else {
+        while (running) execute();
     }
 }
@@ -73,6 +73,10 @@ done:
     lda #1
     jmp BASIC
 
+    org $ffcd
+RETURN:             ; emulator returns here from BASIC routines done in C
+    rts
+
     trap OSFIND 
     trap OSBPUT 
     trap OSBGET 